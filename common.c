@@ -20,9 +20,9 @@
 
 #include "xropen.h"
 
-#define N_ATOMS 7
+#define N_ATOMS 11
 
-xcb_connection_t *display;
+__thread xcb_connection_t *display;
 struct ropen_atoms atom;
 
 void
@@ -30,7 +30,7 @@ start_display(void)
 {
     static const char *const name[] = {
         "XROPEN", "TIMESTAMP", "DATA", "FILE-NAME", "CONTENT-TYPE", "SIZE",
-        "ERROR",
+        "ERROR", "XROPEN-CAPABILITIES", "FLAGS", "OFFSET", "TOKEN",
     };
     xcb_intern_atom_cookie_t atom_cookie[N_ATOMS];
     xcb_intern_atom_reply_t *r;
@@ -86,3 +86,13 @@ copy_string_prop(xcb_get_property_reply_t *prop)
     memcpy(r, xcb_get_property_value(prop), prop->value_len);
     return r;
 }
+
+/* Monotonic, in microseconds, for delays: the wall clock can step backwards */
+uint64_t
+get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,107 @@
+#!/bin/sh
+# Copyright (c) 2012-2020 Nicolas George
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# version 2.0 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+# Stress test for the handshake: run many concurrent xropen against one
+# xropen-server on a private Xvfb display and report stalled transfers.
+#
+# Usage: ./stress.sh [runs [parallel [stall_seconds [workers]]]]
+# With XROPEN_STRESS_AGENT=1, the transfers go through an xropen -A agent.
+
+# One run: print its wall time in milliseconds, or STALL / REJECT / FAIL.
+if [ "$1" = --one ]; then
+    case $(($2 % 4)) in
+        0) f=empty ;;
+        1) f=small.txt ;;
+        2) f=medium.bin ;;
+        3) f=large.bin ;;
+    esac
+    start=$(date +%s%N)
+    err=$(timeout "$stall" "$here/xropen" -q "$work/$f" 2>&1 >/dev/null)
+    status=$?
+    end=$(date +%s%N)
+    [ -n "$err" ] && printf '%s\n' "$err" >>"$work/errors"
+    if [ $status -eq 124 ]; then
+        echo STALL
+    elif [ $status -ne 0 ] && { [ -z "${err##*too many clients*}" ] ||
+                                [ -z "${err##*too many transfers*}" ]; }; then
+        echo REJECT
+    elif [ $status -ne 0 ]; then
+        echo FAIL
+    else
+        echo $(((end - start) / 1000000))
+    fi
+    exit 0
+fi
+
+runs=${1:-2000}
+workers=${4:-1}
+# the server accepts 16 clients per worker, more are rejected, not stalled
+parallel=${2:-$((16 * workers))}
+stall=${3:-20}
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d /tmp/xropen-stress.XXXXXX) || exit 1
+export here work stall
+display_num=${XROPEN_STRESS_DISPLAY:-99}
+
+cleanup() {
+    [ -n "$agent_pid" ] && kill "$agent_pid" 2>/dev/null
+    [ -n "$server_pid" ] && kill "$server_pid" 2>/dev/null
+    [ -n "$xvfb_pid" ] && kill "$xvfb_pid" 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+Xvfb ":$display_num" -nolisten tcp >"$work/xvfb.log" 2>&1 &
+xvfb_pid=$!
+DISPLAY=":$display_num"
+export DISPLAY
+# talk to the private server directly, not through the user's agent
+XROPEN_AGENT=
+export XROPEN_AGENT
+sleep 1
+
+mkdir "$work/spool"
+"$here/xropen-server" -j "$workers" -d "$work/spool" -c 'rm "$1"' &
+server_pid=$!
+sleep 1
+
+if [ -n "$XROPEN_STRESS_AGENT" ]; then
+    XROPEN_AGENT="$work/agent"
+    "$here/xropen" -A &
+    agent_pid=$!
+    sleep 1
+fi
+
+head -c 0 /dev/zero        >"$work/empty"
+head -c 3000 /dev/urandom  >"$work/small.txt"
+head -c 200000 /dev/urandom >"$work/medium.bin"
+head -c 3000000 /dev/urandom >"$work/large.bin"
+
+seq "$runs" | xargs -P "$parallel" -I{} "$here/stress.sh" --one {} \
+    >"$work/results"
+
+stalls=$(grep -c STALL "$work/results")
+fails=$(grep -c FAIL "$work/results")
+rejects=$(grep -c REJECT "$work/results")
+sort -n "$work/results" | grep -v '[A-Z]' | awk -v runs="$runs" '
+    { t[NR] = $1 }
+    END {
+        if (NR == 0) exit
+        printf "%d/%d completed, median %d ms, p99 %d ms, max %d ms\n",
+            NR, runs, t[int(NR / 2) + 1], t[int(NR * 0.99) + 1], t[NR]
+    }'
+echo "$stalls stalled, $fails failed, $rejects rejected (too many clients)"
+[ -s "$work/errors" ] && sort "$work/errors" | uniq -c | sort -rn | head
+kill -0 "$server_pid" 2>/dev/null || { echo "xropen-server died"; exit 1; }
+[ -z "$agent_pid" ] || kill -0 "$agent_pid" 2>/dev/null ||
+    { echo "xropen agent died"; exit 1; }
+[ "$stalls" -eq 0 ] && [ "$fails" -eq 0 ]
@@ -11,6 +11,8 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE /* memfd_create */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,13 +22,18 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <spawn.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
 #include <xcb/xcb.h>
 
 #include "xropen.h"
 
 #define MAX_CLIENTS 16
+#define MAX_WORKERS 64
 
 #define MAX_DATA_SIZE (16 * 1024 * 1024)
 
@@ -35,13 +42,33 @@
 #define MAX_FILE_EXT        16
 #define MAX_FILE_INDEX     100
 
+/* Largest file delivered from memory in memfd mode */
+#define MAX_MEMFD_SIZE ((off_t)32 * 1024 * 1024)
+
+/* Timeouts in microseconds, and the period of the sweep that enforces them */
+#define HANDSHAKE_TIMEOUT ((uint64_t)10 * 1000000)
+#define TRANSFER_TIMEOUT  ((uint64_t)30 * 1000000)
+#define SWEEP_INTERVAL    2
+
+enum client_phase {
+    PHASE_HANDSHAKE,    /* waiting for the first data packet */
+    PHASE_TRANSFER,     /* waiting for the next data packet */
+    PHASE_WATCH,        /* opened, waiting for the next update */
+    PHASE_UPDATE,       /* waiting for the next chunk of an update */
+};
+
 struct xropen_client {
     xcb_window_t window;
+    enum client_phase phase;
     char *file_name;
     char *file_type;
     off_t file_size;
     off_t file_pos;
     FILE *file;
+    int in_memory;
+    int watch;
+    char *update_name;
+    int update_fd;
     uint64_t last_activity;
 };
 
@@ -50,29 +77,182 @@ const char *program_name = "xropen-server";
 static char *open_command = "see \"${2:+$2:}$1\" && "
                             "rm \"$1\" || "
                             "xmessage \"Could not open $1\"";
+static char *memfd_open_command = "see \"${2:+$2:}$1\" || "
+                                  "xmessage \"Could not open $1\"";
 static char *temp_dir     = "/tmp";
+static int option_memfd   = 0;
 
 static xcb_window_t server;
-static struct xropen_client all_clients[MAX_CLIENTS];
-static unsigned all_clients_size = 0;
 
-static uint64_t
-get_time(void)
+/*
+ * Each worker thread has its own connection, clients and sweep timer; the
+ * main thread is worker 0 and also receives the pings on the server window.
+ */
+static __thread struct xropen_client all_clients[MAX_CLIENTS];
+static __thread unsigned all_clients_size = 0;
+static __thread int sweep_timer = -1;
+static __thread int sweep_timer_armed = 0;
+/* when the event being handled was received, or recorded for a replay */
+static __thread uint64_t event_time;
+
+struct worker {
+    pthread_t thread;
+    xcb_connection_t *display;
+    int pipe[2];        /* pings of new clients, from the main thread; to
+                           the main thread, wakeups after clients closed */
+    unsigned load;      /* clients routed to it */
+};
+
+struct ping {
+    xcb_window_t window;
+    uint32_t token;
+};
+
+static struct worker workers[MAX_WORKERS] = { { .pipe = { -1, -1 } } };
+static unsigned n_workers = 1;
+static __thread struct worker *self;
+
+/* Which worker has each client, so that repeated pings go to the same one */
+struct route {
+    xcb_window_t window;
+    struct worker *worker;
+};
+
+static pthread_mutex_t routes_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct route routes[MAX_CLIENTS * MAX_WORKERS];
+static unsigned routes_size = 0;
+static unsigned long reaped_clients = 0;
+
+/* Only one child at a time may inherit a memfd */
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t capabilities[N_CAPS] = {
+    [CAP_VERSION]       = PROTOCOL_VERSION,
+    [CAP_MAX_DATA_SIZE] = MAX_DATA_SIZE,
+    [CAP_MODES]         = MODE_CHUNKED | MODE_INLINE | MODE_WATCH,
+    [CAP_CODECS]        = CODEC_RAW,
+};
+
+/*
+ * Traces: a header with the server window and the atoms, then records of
+ * the events received, of the sweeps and of the GetProperty replies, with
+ * their time. A replay feeds the events and sweeps to the handlers, at
+ * their recorded time for the timeouts, and answers their property
+ * requests from the trace, on a connection in error state that makes all
+ * the other requests no-ops.
+ */
+#define TRACE_MAGIC "XROPTRC1"
+
+enum trace_record_type {
+    TRACE_EVENT,
+    TRACE_REPLY,
+    TRACE_SWEEP,
+};
+
+struct trace_header {
+    char magic[8];
+    uint32_t server;
+    uint32_t atoms_size;
+    struct ropen_atoms atoms;
+};
+
+struct trace_record {
+    uint32_t type;
+    uint32_t size;
+    uint64_t time;
+};
+
+static FILE *trace_record_file = NULL;
+static FILE *trace_replay_file = NULL;
+static uint64_t trace_start;
+static unsigned long trace_replies = 0;
+static uint64_t trace_reply_bytes = 0;
+
+/*
+ * Only the main thread publishes the capabilities, so that they reach the
+ * X server in order; called with routes_lock held, or before the workers
+ * are started.
+ */
+static void
+update_capabilities(void)
 {
-    struct timeval tv;
+    capabilities[CAP_ACTIVE_CLIENTS] = routes_size;
+    xcb_change_property(display, XCB_PROP_MODE_REPLACE, server,
+        atom.capabilities, XCB_ATOM_INTEGER, 32, N_CAPS, capabilities);
+}
 
-    gettimeofday(&tv, NULL);
-    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+static void
+write_trace(enum trace_record_type type, uint64_t time, const void *data,
+    size_t size)
+{
+    struct trace_record rec = {
+        .type = type,
+        .size = size,
+        .time = time - trace_start,
+    };
+
+    if (fwrite(&rec, sizeof(rec), 1, trace_record_file) != 1 ||
+        fwrite(data, 1, size, trace_record_file) != size) {
+        perror("trace");
+        exit(1);
+    }
+}
+
+static void
+die_bad_trace(void)
+{
+    fprintf(stderr, "%s: trace truncated or out of sync\n", program_name);
+    exit(1);
+}
+
+static xcb_get_property_reply_t *
+replay_reply(void)
+{
+    struct trace_record rec;
+    xcb_get_property_reply_t *prop;
+
+    if (fread(&rec, sizeof(rec), 1, trace_replay_file) != 1 ||
+        rec.type != TRACE_REPLY ||
+        (rec.size != 0 && rec.size < sizeof(*prop)))
+        die_bad_trace();
+    if (rec.size == 0)
+        return NULL;
+    prop = calloc_safe(1, rec.size);
+    if (fread(prop, 1, rec.size, trace_replay_file) != rec.size)
+        die_bad_trace();
+    trace_replies++;
+    trace_reply_bytes += rec.size;
+    return prop;
+}
+
+/* All the server's GetProperty replies go through here */
+static xcb_get_property_reply_t *
+get_property_reply(xcb_get_property_cookie_t cookie)
+{
+    xcb_get_property_reply_t *prop;
+
+    if (trace_replay_file != NULL)
+        return replay_reply();
+    prop = xcb_get_property_reply(display, cookie, NULL);
+    if (trace_record_file != NULL)
+        write_trace(TRACE_REPLY, get_time(), prop, prop == NULL ? 0 :
+            sizeof(*prop) + xcb_get_property_value_length(prop));
+    return prop;
 }
 
 static void
 create_window(void)
 {
     xcb_screen_t *screen;
-    uint64_t timestamp = get_time();
+    struct timeval tv;
+    uint64_t timestamp;
     uint32_t timestamp_dec[2];
     uint32_t values[3];
 
+    /* wall time: compared with the servers of previous sessions */
+    gettimeofday(&tv, NULL);
+    timestamp = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
     screen = xcb_setup_roots_iterator(xcb_get_setup(display)).data;
     server = xcb_generate_id(display);
     values[0] = screen->black_pixel;
@@ -91,6 +271,7 @@ create_window(void)
         strlen(program_name), program_name);
     xcb_change_property(display, XCB_PROP_MODE_REPLACE, server,
         atom.xropen, atom.timestamp, 32, 2, timestamp_dec);
+    update_capabilities();
 
     xcb_flush(display);
 }
@@ -106,17 +287,50 @@ remove_if_same(char *name, FILE *f)
     unlink(name);
 }
 
+static void
+remove_route(xcb_window_t window)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&routes_lock);
+    for (i = 0; i < routes_size; i++) {
+        if (routes[i].window == window) {
+            routes[i].worker->load--;
+            routes[i] = routes[--routes_size];
+            break;
+        }
+    }
+    if (self == &workers[0])
+        update_capabilities();
+    pthread_mutex_unlock(&routes_lock);
+    /* if the pipe is full, the main thread is already woken up */
+    if (self != &workers[0] && write(workers[0].pipe[1], "", 1) < 0 &&
+        errno != EAGAIN) {
+        perror("write");
+        exit(1);
+    }
+}
+
 static void
 close_client(struct xropen_client *client)
 {
     if (client->file != NULL) {
-        remove_if_same(client->file_name, client->file);
+        if (!client->in_memory)
+            remove_if_same(client->file_name, client->file);
         fclose(client->file);
     }
+    if (client->update_name != NULL) {
+        close(client->update_fd);
+        unlink(client->update_name);
+        free(client->update_name);
+    }
+    if (client->watch && open_command == NULL && client->file_name != NULL)
+        unlink(client->file_name);
     free(client->file_name);
     free(client->file_type);
+    remove_route(client->window);
     all_clients_size--;
-    while (client < all_clients + all_clients_size)
+    for (; client < all_clients + all_clients_size; client++)
         client[0] = client[1];
 }
 
@@ -219,8 +433,36 @@ is_safe_char(char c)
            (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.';
 }
 
-static void
-open_temp_file(struct xropen_client *client, char *name, char *type)
+/*
+ * The memfd is handed to the opener as /proc/self/fd/N: the descriptor is
+ * inherited through the exec chain and the data lives only in memory, it is
+ * released when the last process using it exits.
+ */
+static int
+open_memory_file(struct xropen_client *client, char *base)
+{
+    char filename[64];
+    unsigned len;
+    int fd;
+
+    if ((fd = memfd_create(base, MFD_CLOEXEC)) < 0)
+        return -1;
+    len = snprintf(filename, sizeof(filename), "/proc/self/fd/%d", fd);
+    client->file_name = calloc_safe(1, len + 1);
+    memcpy(client->file_name, filename, len + 1);
+    if ((client->file = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        free(client->file_name);
+        client->file_name = NULL;
+        return -1;
+    }
+    client->in_memory = 1;
+    return 0;
+}
+
+static int
+open_temp_file(struct xropen_client *client, char *name, char *type,
+    off_t size)
 {
     char filename[MAX_TEMP_DIR + MAX_FILE_BASENAME + MAX_FILE_EXT + 128];
     char *filename_end = filename + sizeof(filename);
@@ -229,7 +471,7 @@ open_temp_file(struct xropen_client *client, char *name, char *type)
     char *temp_end, *p, *base_end;
     unsigned i, len;
     time_t now;
-    struct tm *tm;
+    struct tm tm;
     int fd;
 
     check_file_extension(name, type, ext, &name_end);
@@ -241,16 +483,26 @@ open_temp_file(struct xropen_client *client, char *name, char *type)
     *(temp_end++) = '/';
 
     time(&now);
-    tm = localtime(&now);
+    localtime_r(&now, &tm);
     temp_end += snprintf(temp_end, filename_end - temp_end,
         "xropen-%04d%02d%02d-%02d%02d%02d-XX-",
-        tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
-        tm->tm_hour, tm->tm_min, tm->tm_sec);
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+        tm.tm_hour, tm.tm_min, tm.tm_sec);
 
     for (p = name, base_end = temp_end; p < name_end; p++, base_end++)
         *base_end = is_safe_char(*p) ? *p : '_';
     memcpy(base_end, ext, sizeof(ext));
 
+    /*
+     * Updates are renamed over the file, it needs a real name; without a
+     * type, the opener could only guess from the extension, which
+     * /proc/self/fd/N lacks.
+     */
+    if (option_memfd && size <= MAX_MEMFD_SIZE && !client->watch &&
+        type != NULL &&
+        open_memory_file(client, temp_end) == 0)
+        return 0;
+
     for (i = 0; i < MAX_FILE_INDEX; i++) {
         temp_end[-3] = '0' + i / 10;
         temp_end[-2] = '0' + i % 10;
@@ -259,125 +511,340 @@ open_temp_file(struct xropen_client *client, char *name, char *type)
     }
     if (fd < 0) {
         kill_client(client, NULL);
-        return;
+        return -1;
     }
     len = strlen(filename);
     client->file_name = calloc_safe(1, len + 1);
     memcpy(client->file_name, filename, len + 1);
     if ((client->file = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        unlink(client->file_name);
         kill_client(client, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+open_file(struct xropen_client *client)
+{
+    posix_spawnattr_t attr;
+    pid_t child;
+    char *cmd[] = { "sh", "-c",
+        client->in_memory ? memfd_open_command : open_command, "sh",
+        client->file_name,
+        client->file_type == NULL ? NULL : client->file_type,
+        NULL };
+    extern char **environ; /* ??? */
+    const char *err = NULL;
+
+    if (!client->in_memory) {
+        fclose(client->file);
+        client->file = NULL;
+    }
+
+    /*
+     * Replay without -c: a fork per file would dwarf what is measured.
+     * Watched files are removed when the watch ends, in close_client().
+     */
+    if (cmd[2] == NULL) {
+        if (!client->in_memory && !client->watch)
+            unlink(client->file_name);
+        goto opened;
+    }
+    pthread_mutex_lock(&spawn_lock);
+    if (client->in_memory) {
+        /* only this child inherits the memfd; it is closed here after */
+        fflush(client->file);
+        fcntl(fileno(client->file), F_SETFD, 0);
+    }
+    if (posix_spawnattr_init(&attr) < 0) {
+        err = "posix_spawnattr_init";
+    } else {
+        if (posix_spawnattr_setpgroup(&attr, 0) < 0)
+            err = "posix_spawnattr_setpgroup";
+        else if (posix_spawn(&child, "/bin/sh", NULL, &attr, cmd,
+            environ) < 0)
+            err = "posix_spawn";
+        posix_spawnattr_destroy(&attr);
+    }
+    if (client->in_memory)
+        fcntl(fileno(client->file), F_SETFD, FD_CLOEXEC);
+    pthread_mutex_unlock(&spawn_lock);
+    if (err != NULL) {
+        kill_client(client, err);
         return;
     }
+opened:
+    if (client->watch) {
+        client->phase         = PHASE_WATCH;
+        client->last_activity = event_time;
+        return;
+    }
+    close_client(client);
+}
+
+static struct xropen_client *
+find_client(xcb_window_t window)
+{
+    unsigned i;
+
+    for (i = 0; i < all_clients_size; i++)
+        if (all_clients[i].window == window)
+            return &all_clients[i];
+    return NULL;
 }
 
 static void
-start_client(xcb_window_t window)
+start_client(xcb_window_t window, uint32_t token)
 {
     struct xropen_client *client;
     xcb_get_property_cookie_t cookie_name, cookie_type, cookie_size;
-    xcb_get_property_reply_t *prop_name, *prop_type, *prop_size;
+    xcb_get_property_cookie_t cookie_data, cookie_flags, cookie_token;
+    xcb_get_property_reply_t *prop_name, *prop_type, *prop_size, *prop_data;
+    xcb_get_property_reply_t *prop_flags, *prop_token;
     uint32_t *size_val;
     off_t size;
+    unsigned data_size;
     char *name = NULL, *type = NULL;
     uint32_t events[1] = { XCB_EVENT_MASK_PROPERTY_CHANGE |
         XCB_EVENT_MASK_STRUCTURE_NOTIFY};
 
-    if (all_clients_size == MAX_CLIENTS) {
-        kill_non_client(window, "too many clients");
+    /*
+     * Repeated ping: the client's watchdog finds DATA deleted by itself;
+     * deleting it again could drop a chunk set since.
+     */
+    if (find_client(window) != NULL)
         return;
-    }
+    /* dispatch_client() has checked the room */
     client = &all_clients[all_clients_size++];
+    memset(client, 0, sizeof(*client));
 
-    client->window = window;
+    client->window        = window;
+    client->phase         = PHASE_HANDSHAKE;
+    client->last_activity = event_time;
     cookie_name = xcb_get_property(display, 0, client->window,
         atom.file_name, XCB_ATOM_STRING, 0, FILENAME_MAX);
     cookie_type = xcb_get_property(display, 0, client->window,
         atom.content_type, XCB_ATOM_STRING, 0, FILENAME_MAX);
     cookie_size = xcb_get_property(display, 0,
         client->window, atom.size, XCB_ATOM_INTEGER, 0, 2);
+    /* the first chunk, or the whole file, may come with the handshake */
+    cookie_data = xcb_get_property(display, 0, client->window, atom.data,
+        atom.data, 0, MAX_DATA_SIZE / 4);
+    cookie_flags = xcb_get_property(display, 0, client->window, atom.flags,
+        XCB_ATOM_INTEGER, 0, 1);
+    cookie_token = xcb_get_property(display, 0, client->window, atom.token,
+        XCB_ATOM_INTEGER, 0, 1);
 
-    prop_name = xcb_get_property_reply(display, cookie_name, NULL);
-    prop_type = xcb_get_property_reply(display, cookie_type, NULL);
-    prop_size = xcb_get_property_reply(display, cookie_size, NULL);
+    prop_name = get_property_reply(cookie_name);
+    prop_type = get_property_reply(cookie_type);
+    prop_size = get_property_reply(cookie_size);
+    prop_data = get_property_reply(cookie_data);
+    prop_flags = get_property_reply(cookie_flags);
+    prop_token = get_property_reply(cookie_token);
 
+    /* late copy of a ping already handled: the client may even be gone */
+    if (token != 0 && (prop_token == NULL ||
+        prop_token->type != XCB_ATOM_INTEGER || prop_token->format != 32 ||
+        prop_token->value_len != 1 ||
+        *(uint32_t *)xcb_get_property_value(prop_token) != token)) {
+        close_client(client);
+        goto fail;
+    }
     if (prop_size == NULL ||
         prop_size->type != XCB_ATOM_INTEGER  ||
         prop_size->format != 32 ||
         prop_size->value_len < 1 || prop_size->value_len > 2)
-        goto fail;
-    if (prop_name != NULL && prop_type->format != 0 &&
+        goto invalid;
+    if (prop_name != NULL && prop_name->format != 0 &&
         (prop_name->type != XCB_ATOM_STRING || prop_name->format != 8))
-        goto fail;
+        goto invalid;
     if (prop_type != NULL && prop_type->format != 0 &&
         (prop_type->type != XCB_ATOM_STRING || prop_type->format != 8))
-        goto fail;
+        goto invalid;
+    if (prop_data != NULL && prop_data->format != 0 &&
+        (prop_data->type != atom.data || prop_data->format != 8 ||
+         prop_data->bytes_after > 0))
+        goto invalid;
 
     size_val = xcb_get_property_value(prop_size);
     size = size_val[0];
     if (prop_size->value_len > 1)
         size += (off_t)size_val[1] << 32;
+    data_size = prop_data == NULL ? 0 : prop_data->value_len;
+    if (data_size > size)
+        goto invalid;
+    if (prop_flags != NULL && prop_flags->type == XCB_ATOM_INTEGER &&
+        prop_flags->format == 32 && prop_flags->value_len == 1)
+        client->watch = (*(uint32_t *)xcb_get_property_value(prop_flags) &
+            FLAG_WATCH) != 0;
     name = copy_string_prop(prop_name);
     type = copy_string_prop(prop_type);
 
-    open_temp_file(client, name, type);
+    if (open_temp_file(client, name, type, size) < 0) {
+        free(name);
+        free(type);
+        goto fail;
+    }
     free(name);
+    client->file_type     = type;
+    client->file_size     = size;
+    client->file_pos      = 0;
+    if (data_size > 0) {
+        if (fwrite(xcb_get_property_value(prop_data), 1, data_size,
+            client->file) != data_size) {
+            kill_client(client, NULL);
+            goto fail;
+        }
+        client->file_pos = data_size;
+        client->phase    = PHASE_TRANSFER;
+    }
+
     xcb_change_window_attributes(display, client->window,
         XCB_CW_EVENT_MASK, events);
     xcb_delete_property(display, client->window, atom.data);
+    xcb_delete_property(display, client->window, atom.token);
     xcb_flush(display);
+    if (client->file_pos == client->file_size)
+        open_file(client);
+    goto fail;
 
-    client->file_type     = type;
-    client->file_size     = size;
-    client->file_pos      = 0;
-    client->last_activity = get_time();
-
+invalid:
+    kill_client(client, "invalid properties");
 fail:
     free(prop_name);
     free(prop_type);
     free(prop_size);
+    free(prop_data);
+    free(prop_flags);
+    free(prop_token);
 }
 
-static void
-open_file(struct xropen_client *client)
+/*
+ * The update is built in a copy of the file next to it, and renamed over
+ * it when complete, so that viewers that reload never see it half-done.
+ */
+static int
+begin_update(struct xropen_client *client, off_t size)
 {
-    posix_spawnattr_t attr;
-    pid_t child;
-    char *cmd[] = { "sh", "-c", open_command, "sh",
-        client->file_name,
-        client->file_type == NULL ? NULL : client->file_type,
-        NULL };
-    extern char **environ; /* ??? */
+    char name[MAX_TEMP_DIR + MAX_FILE_BASENAME + MAX_FILE_EXT + 160];
+    unsigned len;
+    ssize_t r;
+    int src;
 
-    fclose(client->file);
-    client->file = NULL;
-
-    if (posix_spawnattr_init(&attr) < 0) {
-        kill_client(client, "posix_spawnattr_init");
-        return;
+    if ((src = open(client->file_name, O_RDONLY)) < 0) {
+        kill_client(client, errno == ENOENT ?
+            "file closed by the viewer" : NULL);
+        return -1;
     }
-    if (posix_spawnattr_setpgroup(&attr, 0) < 0) {
-        posix_spawnattr_destroy(&attr);
-        kill_client(client, "posix_spawnattr_setpgroup");
-        return;
+    len = snprintf(name, sizeof(name), "%s.update", client->file_name);
+    client->update_name = calloc_safe(1, len + 1);
+    memcpy(client->update_name, name, len + 1);
+    if ((client->update_fd = open(client->update_name,
+        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+        free(client->update_name);
+        client->update_name = NULL;
+        close(src);
+        kill_client(client, NULL);
+        return -1;
     }
-    if (posix_spawn(&child, "/bin/sh", NULL, &attr, cmd, environ) < 0) {
-        posix_spawnattr_destroy(&attr);
-        kill_client(client, "posix_spawn");
+    /* in the kernel, and a reflink on filesystems that can */
+    while ((r = copy_file_range(src, NULL, client->update_fd, NULL,
+        MAX_DATA_SIZE, 0)) > 0);
+    close(src);
+    if (r < 0 || ftruncate(client->update_fd, size) < 0) {
+        kill_client(client, NULL);
+        return -1;
+    }
+    client->file_size = size;
+    client->phase     = PHASE_UPDATE;
+    return 0;
+}
+
+static void
+commit_update(struct xropen_client *client)
+{
+    if (rename(client->update_name, client->file_name) < 0) {
+        kill_client(client, NULL);
         return;
     }
-    posix_spawnattr_destroy(&attr);
-    close_client(client);
+    close(client->update_fd);
+    free(client->update_name);
+    client->update_name = NULL;
+    client->phase       = PHASE_WATCH;
 }
 
-struct xropen_client *
-find_client(xcb_window_t window)
+static void
+handle_update(struct xropen_client *client)
 {
-    unsigned i;
+    xcb_get_property_cookie_t cookie_data, cookie_size, cookie_offset;
+    xcb_get_property_reply_t *prop_data, *prop_size, *prop_offset;
+    uint32_t *val;
+    off_t size = client->file_size, offset = 0;
+    unsigned len;
 
-    for (i = 0; i < all_clients_size; i++)
-        if (all_clients[i].window == window)
-            return &all_clients[i];
-    return NULL;
+    cookie_data = xcb_get_property(display, 0, client->window, atom.data,
+        atom.data, 0, MAX_DATA_SIZE / 4);
+    cookie_size = xcb_get_property(display, 0, client->window, atom.size,
+        XCB_ATOM_INTEGER, 0, 2);
+    cookie_offset = xcb_get_property(display, 0, client->window, atom.offset,
+        XCB_ATOM_INTEGER, 0, 2);
+    prop_data   = get_property_reply(cookie_data);
+    prop_size   = get_property_reply(cookie_size);
+    prop_offset = get_property_reply(cookie_offset);
+
+    if (prop_data == NULL || prop_data->type != atom.data ||
+        prop_data->format != 8 || prop_data->bytes_after > 0)
+        goto invalid;
+    len = prop_data->value_len;
+    if (prop_size != NULL && prop_size->type == XCB_ATOM_INTEGER &&
+        prop_size->format == 32 && prop_size->value_len >= 1 &&
+        prop_size->value_len <= 2) {
+        val  = xcb_get_property_value(prop_size);
+        size = val[0];
+        if (prop_size->value_len > 1)
+            size += (off_t)val[1] << 32;
+    }
+    if (prop_offset != NULL && prop_offset->type == XCB_ATOM_INTEGER &&
+        prop_offset->format == 32 && prop_offset->value_len == 2) {
+        val    = xcb_get_property_value(prop_offset);
+        offset = val[0] | (off_t)val[1] << 32;
+    } else if (len > 0) {
+        goto invalid;
+    }
+
+    if (client->phase == PHASE_WATCH && begin_update(client, size) < 0)
+        goto fail;
+    /* the file may have shrunk while the client was reading it */
+    if (size != client->file_size) {
+        if (ftruncate(client->update_fd, size) < 0) {
+            kill_client(client, NULL);
+            goto fail;
+        }
+        client->file_size = size;
+    }
+    if (offset + len > client->file_size)
+        goto invalid;
+    if (len > 0 && pwrite(client->update_fd, xcb_get_property_value(prop_data),
+        len, offset) != len) {
+        kill_client(client, NULL);
+        goto fail;
+    }
+
+    xcb_delete_property(display, client->window, atom.data);
+    xcb_flush(display);
+    client->last_activity = event_time;
+    if (len == 0)
+        commit_update(client);
+    goto fail;
+
+invalid:
+    kill_client(client, "invalid update");
+fail:
+    free(prop_data);
+    free(prop_size);
+    free(prop_offset);
 }
 
 static void
@@ -393,6 +860,10 @@ handle_property_change(xcb_property_notify_event_t *ev)
     if (ev->atom != atom.data || ev->state != XCB_PROPERTY_NEW_VALUE ||
         (client = find_client(ev->window)) == NULL)
         return;
+    if (client->phase == PHASE_WATCH || client->phase == PHASE_UPDATE) {
+        handle_update(client);
+        return;
+    }
 
     miss = client->file_size - client->file_pos;
     if (miss <= 0) {
@@ -404,7 +875,7 @@ handle_property_change(xcb_property_notify_event_t *ev)
     miss = (miss + 3) / 4;
     cookie = xcb_get_property(display, 0, client->window, atom.data, atom.data,
         0, miss);
-    prop = xcb_get_property_reply(display, cookie, NULL);
+    prop = get_property_reply(cookie);
     if (prop == NULL || prop->type != atom.data || prop->format != 8 ||
         prop->bytes_after > 0) {
         free(prop);
@@ -415,6 +886,7 @@ handle_property_change(xcb_property_notify_event_t *ev)
     size = prop->value_len;
     data = xcb_get_property_value(prop);
     if (fwrite(data, 1, size, client->file) != size) {
+        free(prop);
         kill_client(client, NULL);
         return;
     }
@@ -423,6 +895,8 @@ handle_property_change(xcb_property_notify_event_t *ev)
     xcb_delete_property(display, client->window, atom.data);
     xcb_flush(display);
 
+    client->phase         = PHASE_TRANSFER;
+    client->last_activity = event_time;
     client->file_pos += size;
     if (client->file_pos == client->file_size)
         open_file(client);
@@ -438,44 +912,425 @@ handle_destroy(xcb_destroy_notify_event_t *ev)
     close_client(client);
 }
 
+/*
+ * A new client goes to the least loaded worker, which reads its properties
+ * and selects its events on its own connection; repeated pings follow it.
+ */
+static void
+dispatch_client(xcb_window_t window, uint32_t token)
+{
+    struct worker *worker = NULL;
+    unsigned i;
+
+    pthread_mutex_lock(&routes_lock);
+    for (i = 0; i < routes_size && worker == NULL; i++)
+        if (routes[i].window == window)
+            worker = routes[i].worker;
+    if (worker == NULL) {
+        worker = &workers[0];
+        for (i = 1; i < n_workers; i++)
+            if (workers[i].load < worker->load)
+                worker = &workers[i];
+        if (worker->load == MAX_CLIENTS) {
+            pthread_mutex_unlock(&routes_lock);
+            kill_non_client(window, "too many clients");
+            return;
+        }
+        worker->load++;
+        routes[routes_size].window   = window;
+        routes[routes_size++].worker = worker;
+        update_capabilities();
+    }
+    pthread_mutex_unlock(&routes_lock);
+
+    if (worker == &workers[0]) {
+        start_client(window, token);
+    } else if (write(worker->pipe[1], &(struct ping){ window, token },
+        sizeof(struct ping)) != sizeof(struct ping)) {
+        perror("write");
+        exit(1);
+    }
+}
+
 static void
 handle_client_message(xcb_client_message_event_t *ev)
 {
     if (ev->format != 32 || ev->window != server)
         return;
-    start_client(ev->data.data32[0]);
+    dispatch_client(ev->data.data32[0], ev->data.data32[1]);
+}
+
+static void
+handle_event(xcb_generic_event_t *ev)
+{
+    switch (ev->response_type & ~0x80) {
+        case XCB_CLIENT_MESSAGE:
+            handle_client_message((xcb_client_message_event_t *)ev);
+            break;
+
+        case XCB_PROPERTY_NOTIFY:
+            handle_property_change((xcb_property_notify_event_t *)ev);
+            break;
+
+        case XCB_DESTROY_NOTIFY:
+            handle_destroy((xcb_destroy_notify_event_t *)ev);
+            break;
+
+        default:
+            fprintf(stderr, "%s: unknown event type %d\n", program_name,
+                ev->response_type);
+            break;
+    }
+}
+
+static uint64_t
+phase_timeout(enum client_phase phase)
+{
+    switch (phase) {
+        case PHASE_HANDSHAKE: return HANDSHAKE_TIMEOUT;
+        case PHASE_TRANSFER:  return TRANSFER_TIMEOUT;
+        case PHASE_WATCH:     return UINT64_MAX;
+        case PHASE_UPDATE:    return TRANSFER_TIMEOUT;
+    }
+    return TRANSFER_TIMEOUT;
+}
+
+static void
+sweep_clients(void)
+{
+    uint64_t now = event_time;
+    unsigned i = 0, reaped = 0;
+    struct xropen_client *client;
+
+    while (i < all_clients_size) {
+        client = &all_clients[i];
+        if (now - client->last_activity < phase_timeout(client->phase)) {
+            i++;
+            continue;
+        }
+        /* kill_client() shifts the next client into this slot */
+        kill_client(client, "timeout");
+        reaped++;
+    }
+    if (reaped > 0) {
+        xcb_flush(display);
+        pthread_mutex_lock(&routes_lock);
+        reaped_clients += reaped;
+        fprintf(stderr, "%s: reaped %u stalled client(s), %lu total\n",
+            program_name, reaped, reaped_clients);
+        pthread_mutex_unlock(&routes_lock);
+    }
+}
+
+static void
+update_sweep_timer(void)
+{
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+    unsigned i;
+    int arm = 0;
+
+    /* watching clients may stay idle for days, they need no sweep */
+    for (i = 0; i < all_clients_size && !arm; i++)
+        arm = phase_timeout(all_clients[i].phase) != UINT64_MAX;
+    if (arm == sweep_timer_armed)
+        return;
+    if (arm) {
+        its.it_interval.tv_sec = SWEEP_INTERVAL;
+        its.it_value.tv_sec    = SWEEP_INTERVAL;
+    }
+    if (timerfd_settime(sweep_timer, 0, &its, NULL) < 0) {
+        perror("timerfd_settime");
+        exit(1);
+    }
+    sweep_timer_armed = arm;
+}
+
+static void
+start_trace_record(const char *path)
+{
+    struct trace_header header = {
+        .magic      = TRACE_MAGIC,
+        .server     = server,
+        .atoms_size = sizeof(atom),
+        .atoms      = atom,
+    };
+
+    if ((trace_record_file = fopen(path, "w")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    if (fwrite(&header, sizeof(header), 1, trace_record_file) != 1) {
+        perror(path);
+        exit(1);
+    }
+    trace_start = get_time();
+}
+
+static void
+record_event(xcb_generic_event_t *ev)
+{
+    if (trace_record_file != NULL)
+        write_trace(TRACE_EVENT, event_time, ev, 32);
+}
+
+static void
+record_sweep(void)
+{
+    if (trace_record_file != NULL)
+        write_trace(TRACE_SWEEP, event_time, NULL, 0);
+}
+
+/*
+ * Feed a recorded trace to the handlers, as fast as possible or at the
+ * recorded speed, and report the throughput. Temp files are really
+ * written; the open command is replaced by one that removes them.
+ */
+static void
+replay_trace(const char *path, unsigned passes, int realtime)
+{
+    struct trace_header header;
+    struct trace_record rec;
+    uint8_t ev[32];
+    long data_start;
+    uint64_t start, now, total = 0;
+    unsigned long events = 0;
+    unsigned pass;
+
+    if ((trace_replay_file = fopen(path, "r")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    if (fread(&header, sizeof(header), 1, trace_replay_file) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.atoms_size != sizeof(atom)) {
+        fprintf(stderr, "%s: %s: not a trace\n", program_name, path);
+        exit(1);
+    }
+    server = header.server;
+    atom   = header.atoms;
+    data_start = ftell(trace_replay_file);
+    /* requests on a connection in error state do nothing */
+    display = xcb_connect_to_fd(-1, NULL);
+    self    = &workers[0];
+
+    for (pass = 0; pass < passes; pass++) {
+        fseek(trace_replay_file, data_start, SEEK_SET);
+        start = get_time();
+        while (fread(&rec, sizeof(rec), 1, trace_replay_file) == 1) {
+            if (!(rec.type == TRACE_SWEEP && rec.size == 0) &&
+                (rec.type != TRACE_EVENT || rec.size != sizeof(ev) ||
+                 fread(ev, 1, sizeof(ev), trace_replay_file) != sizeof(ev)))
+                die_bad_trace();
+            if (realtime && (now = get_time() - start) < rec.time)
+                usleep(rec.time - now);
+            event_time = rec.time;
+            if (rec.type == TRACE_SWEEP) {
+                sweep_clients();
+                continue;
+            }
+            handle_event((xcb_generic_event_t *)ev);
+            events++;
+        }
+        total += get_time() - start;
+        /* transfers left unfinished by the trace */
+        while (all_clients_size > 0)
+            close_client(&all_clients[0]);
+    }
+
+    fprintf(stderr, "%s: %lu events, %lu replies, %.1f MB in %.3f s: "
+        "%.0f events/s, %.1f MB/s\n", program_name, events, trace_replies,
+        trace_reply_bytes / 1e6, total / 1e6,
+        total == 0 ? 0 : events * 1e6 / total,
+        total == 0 ? 0 : trace_reply_bytes / (double)total);
+}
+
+static void
+run_worker(struct worker *worker)
+{
+    xcb_generic_event_t *ev;
+    struct pollfd pfd[3];
+    uint64_t expirations;
+    struct ping pings[64];
+    ssize_t r;
+    unsigned i;
+
+    self    = worker;
+    display = worker->display;
+    if ((sweep_timer = timerfd_create(CLOCK_MONOTONIC,
+        TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        perror("timerfd_create");
+        exit(1);
+    }
+    pfd[0].fd     = xcb_get_file_descriptor(display);
+    pfd[0].events = POLLIN;
+    pfd[1].fd     = sweep_timer;
+    pfd[1].events = POLLIN;
+    pfd[2].fd     = worker->pipe[0]; /* -1 with a single worker: ignored */
+    pfd[2].events = POLLIN;
+    while (1) {
+        while ((ev = xcb_poll_for_event(display)) != NULL) {
+            event_time = get_time();
+            record_event(ev);
+            handle_event(ev);
+            free(ev);
+        }
+        if (xcb_connection_has_error(display))
+            break;
+        update_sweep_timer();
+        xcb_flush(display);
+        if (trace_record_file != NULL)
+            fflush(trace_record_file);
+        if (poll(pfd, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(1);
+        }
+        if ((pfd[1].revents & POLLIN) &&
+            read(sweep_timer, &expirations, sizeof(expirations)) > 0) {
+            event_time = get_time();
+            record_sweep();
+            sweep_clients();
+        }
+        if ((pfd[2].revents & POLLIN) && worker == &workers[0]) {
+            while (read(worker->pipe[0], pings, sizeof(pings)) > 0);
+            pthread_mutex_lock(&routes_lock);
+            update_capabilities();
+            pthread_mutex_unlock(&routes_lock);
+            continue;
+        }
+        /* writes of whole pings are atomic, reads get whole pings */
+        if ((pfd[2].revents & POLLIN) &&
+            (r = read(worker->pipe[0], pings, sizeof(pings))) > 0) {
+            event_time = get_time();
+            for (i = 0; i < r / sizeof(*pings); i++)
+                start_client(pings[i].window, pings[i].token);
+        }
+    }
+}
+
+static void *
+worker_thread(void *arg)
+{
+    run_worker(arg);
+    /* the display is gone */
+    exit(0);
+}
+
+static void
+start_workers(void)
+{
+    struct worker *worker;
+    unsigned i;
+
+    if (n_workers > 1 &&
+        pipe2(workers[0].pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    for (i = 1; i < n_workers; i++) {
+        worker = &workers[i];
+        worker->display = xcb_connect(NULL, NULL);
+        if (xcb_connection_has_error(worker->display)) {
+            fprintf(stderr, "%s: unable to open display.\n", program_name);
+            exit(1);
+        }
+        if (pipe2(worker->pipe, O_CLOEXEC) < 0) {
+            perror("pipe");
+            exit(1);
+        }
+        if ((errno = pthread_create(&worker->thread, NULL, worker_thread,
+            worker)) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+}
+
+static void
+usage(int code)
+{
+    fprintf(code ? stderr : stdout,
+        "Usage: %s [-m] [-j workers] [-c open_command] [-d temp_dir] "
+        "[-R trace]\n"
+        "       %s -P trace [-m] [-c open_command] [-d temp_dir] "
+        "[-n passes] [-s]\n", program_name, program_name);
+    exit(code);
 }
 
 int
 main(int argc, char **argv)
 {
-    (void)argc;
-    (void)argv;
-    xcb_generic_event_t *ev;
+    int opt;
+    const char *record_path = NULL, *replay_path = NULL;
+    unsigned replay_passes = 1;
+    int replay_realtime = 0, custom_command = 0;
 
-    signal(SIGCHLD, SIG_IGN);
-    start_display();
-    create_window();
-    while ((ev = xcb_wait_for_event(display)) != NULL) {
-        switch (ev->response_type & ~0x80) {
-            case XCB_CLIENT_MESSAGE:
-                handle_client_message((xcb_client_message_event_t *)ev);
+    while ((opt = getopt(argc, argv, "P:R:c:d:hj:mn:s")) != -1) {
+        switch (opt) {
+            case 'P':
+                replay_path = optarg;
                 break;
-
-            case XCB_PROPERTY_NOTIFY:
-                handle_property_change((xcb_property_notify_event_t *)ev);
+            case 'R':
+                record_path = optarg;
                 break;
-
-            case XCB_DESTROY_NOTIFY:
-                handle_destroy((xcb_destroy_notify_event_t *)ev);
+            case 'n':
+                replay_passes = atoi(optarg);
                 break;
-
-            default:
-                fprintf(stderr, "%s: unknown event type %d\n", program_name,
-                    ev->response_type);
+            case 's':
+                replay_realtime = 1;
+                break;
+            case 'c':
+                open_command       = optarg;
+                memfd_open_command = optarg;
+                custom_command     = 1;
+                break;
+            case 'd':
+                if (strlen(optarg) > MAX_TEMP_DIR) {
+                    fprintf(stderr, "%s: temp dir too long\n", program_name);
+                    exit(1);
+                }
+                temp_dir = optarg;
                 break;
+            case 'j':
+                n_workers = atoi(optarg);
+                if (n_workers < 1 || n_workers > MAX_WORKERS) {
+                    fprintf(stderr, "%s: between 1 and %d workers\n",
+                        program_name, MAX_WORKERS);
+                    exit(1);
+                }
+                break;
+            case 'm':
+                option_memfd = 1;
+                break;
+            case 'h':
+                usage(0);
+                break;
+            default:
+                usage(1);
+        }
+    }
+    /* a trace follows the events and replies of a single connection */
+    if (optind < argc || (replay_path != NULL && record_path != NULL) ||
+        (n_workers > 1 && (replay_path != NULL || record_path != NULL)))
+        usage(1);
+    capabilities[CAP_MAX_CLIENTS] = MAX_CLIENTS * n_workers;
+
+    signal(SIGCHLD, SIG_IGN);
+    if (replay_path != NULL) {
+        if (!custom_command) {
+            open_command       = NULL;
+            memfd_open_command = NULL;
         }
-        free(ev);
+        replay_trace(replay_path, replay_passes, replay_realtime);
+        return 0;
     }
+    start_display();
+    create_window();
+    if (record_path != NULL)
+        start_trace_record(record_path);
+    start_workers();
+    workers[0].display = display;
+    run_worker(&workers[0]);
     return 0;
 }
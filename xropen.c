@@ -11,35 +11,146 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE /* SO_PEERCRED */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <math.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
 #include <xcb/xcb.h>
 
 #include "xropen.h"
 
 const char *program_name = "xropen";
 
+/* Watchdog: first deadline in microseconds, doubled at each retry */
+#define WATCHDOG_TIMEOUT ((uint64_t)500 * 1000)
+#define WATCHDOG_MAX     ((uint64_t)8 * 1000000)
+#define MAX_RETRIES      10
+
+/* Chunk size for servers without capabilities, and our own limit */
+#define LEGACY_CHUNK_SIZE 16384
+#define MAX_CHUNK_SIZE    (256 * 1024)
+
+/*
+ * Rate limiting: with a cap, chunks are cut to about 50 ms of traffic so
+ * that the X11 channel is never held for long. In background mode, the
+ * rate follows the delay of the acknowledgements, LEDBAT-style: it grows
+ * while the round trip stays close to its base and shrinks as soon as
+ * queuing appears on the link.
+ */
+#define MIN_RATE          4096.0
+#define MIN_CHUNK_SIZE    4096
+#define PACING_SLICE      20
+#define BACKGROUND_CHUNK  16384
+#define BACKGROUND_RATE   (64 * 1024.0)
+#define TARGET_DELAY      ((uint64_t)25 * 1000)
+#define LEDBAT_GAIN       0.1
+#define BASE_RTT_PERIOD   ((uint64_t)60 * 1000000)
+
+/* What this client knows how to use */
+#define SUPPORTED_MODES   (MODE_CHUNKED | MODE_INLINE | MODE_WATCH)
+
+/*
+ * Watch mode: the file is compared block by block with what was sent,
+ * using the hash of each block, and only the changed runs are sent. The
+ * update starts a little after the last change, to let the writer finish.
+ */
+#define WATCH_BLOCK       (64 * 1024)
+#define WATCH_DELAY       ((uint64_t)100 * 1000)
+
+/*
+ * Agent: concurrent transfers, requesters accepted but not heard from yet
+ * (the oldest is dropped to make room), and size of a request packet
+ */
+#define MAX_CONNS         64
+#define MAX_PENDING       8
+#define MAX_REQUEST       4096
+
 static int option_quiet = 0;
+static double option_rate = 0;
+static int option_background = 0;
+static int option_detach = 0;
+static int option_watch = 0;
+static int inotify_fd = -1;
+static int agent_mode = 0;
+static char agent_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+enum conn_state {
+    CONN_HANDSHAKE,     /* pinged, waiting for the server to delete DATA */
+    CONN_TRANSFER,      /* data sent, waiting for the server to delete it */
+    CONN_PACED,         /* acknowledged, waiting for the rate limiter */
+    CONN_WATCH,         /* opened, waiting for the file to change */
+    CONN_DONE,
+};
 
 struct xropen_connection {
     xcb_window_t server;
     xcb_window_t client;
+    int requester;          /* agent socket, -1 when running directly */
+    char *error;
+    uint32_t token;
+    enum conn_state state;
+    uint64_t deadline;
+    uint64_t watchdog;
+    unsigned retries;
+    unsigned modes;
+    unsigned chunk_size;
+    uint8_t *buf;
+    double rate;            /* bytes per second, 0 for unlimited */
+    double rate_cap;
+    int background;
+    double tokens;
+    uint64_t tokens_time;
+    uint64_t sent_time;
+    uint64_t base_rtt;
+    uint64_t cur_min_rtt;
+    uint64_t base_rtt_time;
     char *file_name;
     char *file_base;
     char *file_type;
     off_t file_size;
     off_t file_pos;
     FILE *file;
+    int watch;
+    unsigned block_size;
+    uint64_t *hashes;       /* of each block as the server has it */
+    size_t n_hashes;
+    size_t hashes_alloc;
+    uint64_t hash_state;
+    off_t hash_pos;
+    unsigned hash_fill;
+    int updating;
+    int commit_sent;
+    int dirty;
+    int update_fd;
+    off_t scan_pos;
+    off_t server_size;
+    uint64_t update_bytes;
 };
 
+static xcb_window_t server = XCB_NONE;
+static uint32_t server_caps[N_CAPS];
+static struct xropen_connection *all_conns[MAX_CONNS];
+static unsigned all_conns_size = 0;
+static int pending[MAX_PENDING];
+static unsigned pending_size = 0;
+
 static void
 usage(int code)
 {
     fprintf(code ? stderr : stdout,
-        "Usage: %s [-q] [-t mime/type] file\n", program_name);
+        "Usage: %s [-q] [-b] [-n | -w] [-r rate] [-t mime/type] file\n"
+        "       %s -A\n", program_name, program_name);
     exit(code);
 }
 
@@ -50,17 +161,22 @@ die_system_error(const char *comment)
     exit(1);
 }
 
-static void
-find_server(struct xropen_connection *conn)
+static int
+find_server(void)
 {
     xcb_screen_t *screen;
     xcb_query_tree_reply_t *tree;
     unsigned i, n_children;
     xcb_window_t *children;
-    xcb_get_property_cookie_t *cookie;
+    xcb_get_property_cookie_t *cookie, *cookie_caps;
     xcb_get_property_reply_t *prop;
     xcb_window_t found = XCB_NONE;
+    unsigned found_index = 0, n;
+    uint32_t *val;
+    uint64_t timestamp, found_timestamp = 0;
 
+    /* BIG-REQUESTS takes two round trips, let them overlap with ours */
+    xcb_prefetch_maximum_request_length(display);
     screen = xcb_setup_roots_iterator(xcb_get_setup(display)).data;
     tree = xcb_query_tree_reply(display,
         xcb_query_tree(display, screen->root), NULL);
@@ -71,27 +187,147 @@ find_server(struct xropen_connection *conn)
     n_children = xcb_query_tree_children_length(tree);
     children = xcb_query_tree_children(tree);
     cookie = calloc_safe(n_children, sizeof(*cookie));
-    for (i = 0; i < n_children; i++)
+    cookie_caps = calloc_safe(n_children, sizeof(*cookie_caps));
+    for (i = 0; i < n_children; i++) {
         cookie[i] = xcb_get_property(display, 0, children[i],
             atom.xropen, atom.timestamp, 0, 2);
+        cookie_caps[i] = xcb_get_property(display, 0, children[i],
+            atom.capabilities, XCB_ATOM_INTEGER, 0, N_CAPS);
+    }
     for (i = 0; i < n_children; i++) {
         prop = xcb_get_property_reply(display, cookie[i], NULL);
         if (prop == NULL)
             continue;
         if (prop->type == atom.timestamp && prop->format == 32 &&
             prop->value_len == 2) {
-            /* TODO compare timestamps */
-            found = children[i];
+            /* a restarted server supersedes a wedged one */
+            val = xcb_get_property_value(prop);
+            timestamp = val[0] | (uint64_t)val[1] << 32;
+            if (found == XCB_NONE || timestamp > found_timestamp) {
+                found = children[i];
+                found_index = i;
+                found_timestamp = timestamp;
+            }
+        }
+        free(prop);
+    }
+    server = found;
+    memset(server_caps, 0, sizeof(server_caps));
+
+    /* all the replies are already there, read the ones we need */
+    for (i = 0; i < n_children; i++) {
+        prop = xcb_get_property_reply(display, cookie_caps[i], NULL);
+        if (i == found_index && found != XCB_NONE && prop != NULL &&
+            prop->type == XCB_ATOM_INTEGER && prop->format == 32) {
+            n = xcb_get_property_value_length(prop) / 4;
+            memcpy(server_caps, xcb_get_property_value(prop),
+                (n < N_CAPS ? n : N_CAPS) * 4);
         }
         free(prop);
     }
+    free(cookie_caps);
     free(cookie);
     free(tree);
-    if (found == XCB_NONE) {
-        fprintf(stderr, "%s: no server found.\n", program_name);
-        exit(1);
+    return found == XCB_NONE ? -1 : 0;
+}
+
+/* Pick the fastest transfer both sides support */
+static void
+negotiate(struct xropen_connection *conn)
+{
+    unsigned max_request;
+
+    conn->server     = server;
+    conn->modes      = SUPPORTED_MODES & MODE_CHUNKED;
+    conn->chunk_size = LEGACY_CHUNK_SIZE;
+    if (server_caps[CAP_VERSION] >= 1) {
+        conn->modes = SUPPORTED_MODES & (server_caps[CAP_MODES] | MODE_CHUNKED);
+        conn->chunk_size = MAX_CHUNK_SIZE;
+        if (conn->chunk_size > server_caps[CAP_MAX_DATA_SIZE])
+            conn->chunk_size = server_caps[CAP_MAX_DATA_SIZE];
+        /* room for the ChangeProperty header; BIG-REQUESTS only if needed */
+        max_request = xcb_get_setup(display)->maximum_request_length * 4 - 24;
+        if (conn->chunk_size > max_request)
+            max_request = xcb_get_maximum_request_length(display) * 4 - 32;
+        if (conn->chunk_size > max_request)
+            conn->chunk_size = max_request;
+        if (conn->chunk_size < LEGACY_CHUNK_SIZE)
+            conn->chunk_size = LEGACY_CHUNK_SIZE;
+    }
+
+    conn->rate = conn->rate_cap;
+    if (conn->background) {
+        conn->rate = BACKGROUND_RATE;
+        if (conn->rate_cap > 0 && conn->rate > conn->rate_cap)
+            conn->rate = conn->rate_cap;
+        /* constant chunks keep the round trips comparable */
+        if (conn->chunk_size > BACKGROUND_CHUNK)
+            conn->chunk_size = BACKGROUND_CHUNK;
+    } else if (conn->rate > 0 &&
+               conn->chunk_size > conn->rate / PACING_SLICE) {
+        conn->chunk_size = conn->rate / PACING_SLICE;
+        if (conn->chunk_size < MIN_CHUNK_SIZE)
+            conn->chunk_size = MIN_CHUNK_SIZE;
+    }
+    conn->tokens      = conn->chunk_size;
+    conn->tokens_time = get_time();
+    conn->buf = calloc_safe(1, conn->chunk_size);
+    conn->block_size = conn->chunk_size < WATCH_BLOCK ?
+        conn->chunk_size : WATCH_BLOCK;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+static uint64_t
+hash_update(uint64_t h, const uint8_t *data, size_t size)
+{
+    for (; size > 0; size--, data++)
+        h = (h ^ *data) * FNV_PRIME;
+    return h;
+}
+
+static void
+set_block_hash(struct xropen_connection *conn, size_t idx, uint64_t h)
+{
+    if (idx >= conn->hashes_alloc) {
+        conn->hashes_alloc = idx * 2 + 16;
+        if ((conn->hashes = realloc(conn->hashes,
+            conn->hashes_alloc * sizeof(*conn->hashes))) == NULL) {
+            fprintf(stderr, "%s: out of memory.\n", program_name);
+            exit(1);
+        }
+    }
+    conn->hashes[idx] = h;
+    if (idx >= conn->n_hashes)
+        conn->n_hashes = idx + 1;
+}
+
+/* Hash the initial transfer as it is sent, split in blocks */
+static void
+hash_stream(struct xropen_connection *conn, const uint8_t *data, size_t size)
+{
+    size_t n;
+
+    if (!conn->watch)
+        return;
+    while (size > 0) {
+        if (conn->hash_fill == 0)
+            conn->hash_state = FNV_OFFSET;
+        n = conn->block_size - conn->hash_fill;
+        if (n > size)
+            n = size;
+        conn->hash_state = hash_update(conn->hash_state, data, n);
+        conn->hash_fill += n;
+        data += n;
+        size -= n;
+        set_block_hash(conn, conn->hash_pos / conn->block_size,
+            conn->hash_state);
+        if (conn->hash_fill == conn->block_size) {
+            conn->hash_pos += conn->hash_fill;
+            conn->hash_fill = 0;
+        }
     }
-    conn->server = found;
 }
 
 static void
@@ -105,6 +341,7 @@ static void
 create_window(struct xropen_connection *conn)
 {
     xcb_screen_t *screen;
+    unsigned r = 0;
     uint32_t size[2];
     uint32_t events[1] = { XCB_EVENT_MASK_PROPERTY_CHANGE };
 
@@ -122,11 +359,32 @@ create_window(struct xropen_connection *conn)
     size[1] = (uint64_t)conn->file_size >> 32;
     xcb_change_property(display, XCB_PROP_MODE_REPLACE, conn->client,
         atom.size, XCB_ATOM_INTEGER, 32, size[1] != 0 ? 2 : 1, size);
-    set_data_property(conn, NULL, 0);
+    if (conn->watch)
+        xcb_change_property(display, XCB_PROP_MODE_REPLACE, conn->client,
+            atom.flags, XCB_ATOM_INTEGER, 32, 1, &(uint32_t){ FLAG_WATCH });
+    conn->token = (uint32_t)(get_time() ^ conn->client) | 1;
+    xcb_change_property(display, XCB_PROP_MODE_REPLACE, conn->client,
+        atom.token, XCB_ATOM_INTEGER, 32, 1, &conn->token);
+    /* small files are complete when the server reads the handshake */
+    if (conn->modes & MODE_INLINE) {
+        r = fread(conn->buf, 1, conn->chunk_size, conn->file);
+        hash_stream(conn, conn->buf, r);
+        conn->file_pos += r;
+        conn->tokens   -= r;
+    }
+    set_data_property(conn, conn->buf, r);
 
     xcb_flush(display);
 }
 
+static void
+arm_watchdog(struct xropen_connection *conn)
+{
+    conn->watchdog = WATCHDOG_TIMEOUT;
+    conn->retries  = 0;
+    conn->deadline = get_time() + conn->watchdog;
+}
+
 static void
 ping_server(struct xropen_connection *conn)
 {
@@ -136,11 +394,14 @@ ping_server(struct xropen_connection *conn)
         .window         = conn->server,
         .type           = atom.xropen,
         .data.data32[0] = conn->client,
+        .data.data32[1] = conn->token,
     };
 
     xcb_send_event(display, 0, conn->server,
         XCB_EVENT_MASK_NO_EVENT, (char *)&event);
     xcb_flush(display);
+    conn->state = CONN_HANDSHAKE;
+    arm_watchdog(conn);
 }
 
 static void
@@ -149,31 +410,251 @@ print_progress(struct xropen_connection *conn)
     int shift = conn->file_size > ((off_t)1 << (sizeof(off_t) * 8 - 8)) ? 8 : 0;
     int progress = 100 * (conn->file_pos >> shift) / (conn->file_size >> shift);
 
-    if (option_quiet)
+    if (option_quiet || conn->requester >= 0)
         return;
     printf("\r%.64s: %3d%% ", conn->file_base, progress);
     fflush(stdout);
 }
 
 static void
-handle_data_delete(struct xropen_connection *conn)
+fail_connection(struct xropen_connection *conn, const char *fmt, ...)
+{
+    va_list va;
+    int len;
+
+    if (conn->state == CONN_DONE)
+        return;
+    va_start(va, fmt);
+    len = vsnprintf(NULL, 0, fmt, va);
+    va_end(va);
+    conn->error = calloc_safe(1, len + 1);
+    va_start(va, fmt);
+    vsnprintf(conn->error, len + 1, fmt, va);
+    va_end(va);
+    conn->state = CONN_DONE;
+}
+
+/* LEDBAT-style update of the background rate from one round trip */
+static void
+update_background_rate(struct xropen_connection *conn, uint64_t rtt)
+{
+    double off_target, factor;
+
+    if (conn->base_rtt == 0 || rtt < conn->base_rtt)
+        conn->base_rtt = rtt;
+    /* forget old minimums, the route may have changed */
+    if (conn->cur_min_rtt == 0 || rtt < conn->cur_min_rtt)
+        conn->cur_min_rtt = rtt;
+    if (conn->sent_time - conn->base_rtt_time > BASE_RTT_PERIOD) {
+        conn->base_rtt      = conn->cur_min_rtt;
+        conn->cur_min_rtt   = 0;
+        conn->base_rtt_time = conn->sent_time;
+    }
+
+    off_target = ((double)TARGET_DELAY - (double)(rtt - conn->base_rtt)) /
+        TARGET_DELAY;
+    factor = 1 + LEDBAT_GAIN * off_target;
+    if (factor < 0.5)
+        factor = 0.5;
+    conn->rate *= factor;
+    if (conn->rate < MIN_RATE)
+        conn->rate = MIN_RATE;
+    if (conn->rate_cap > 0 && conn->rate > conn->rate_cap)
+        conn->rate = conn->rate_cap;
+}
+
+/* Token bucket: return 0 and set the deadline if we must wait */
+static int
+check_rate(struct xropen_connection *conn)
+{
+    uint64_t now;
+
+    if (conn->rate == 0)
+        return 1;
+    now = get_time();
+    conn->tokens += conn->rate * (now - conn->tokens_time) / 1000000;
+    conn->tokens_time = now;
+    if (conn->tokens > conn->chunk_size)
+        conn->tokens = conn->chunk_size;
+    if (conn->tokens >= 0)
+        return 1;
+    conn->state    = CONN_PACED;
+    conn->deadline = now + (uint64_t)(-conn->tokens * 1000000 / conn->rate);
+    return 0;
+}
+
+/* SIZE and OFFSET: two 32-bit halves, low first */
+static void
+set_int64_property(struct xropen_connection *conn, xcb_atom_t prop, off_t v)
+{
+    uint32_t val[2] = { (uint64_t)v & 0xFFFFFFFF, (uint64_t)v >> 32 };
+
+    xcb_change_property(display, XCB_PROP_MODE_REPLACE, conn->client,
+        prop, XCB_ATOM_INTEGER, 32, 2, val);
+}
+
+static void
+wait_for_changes(struct xropen_connection *conn)
+{
+    conn->state    = CONN_WATCH;
+    conn->deadline = conn->dirty ? get_time() + WATCH_DELAY : UINT64_MAX;
+}
+
+/*
+ * Send the next run of changed blocks, or the empty chunk that commits
+ * the update when the end of the file is reached.
+ */
+static void
+send_update_chunk(struct xropen_connection *conn)
+{
+    unsigned len = 0;
+    off_t offset = 0;
+    size_t idx;
+    ssize_t r;
+    uint64_t h;
+
+    while (conn->scan_pos < conn->file_size &&
+           len + conn->block_size <= conn->chunk_size) {
+        r = pread(conn->update_fd, conn->buf + len, conn->block_size,
+            conn->scan_pos);
+        if (r <= 0) {
+            /* truncated under our feet: send what we have, redo later */
+            conn->file_size = conn->scan_pos;
+            conn->dirty = 1;
+            set_int64_property(conn, atom.size, conn->file_size);
+            break;
+        }
+        idx = conn->scan_pos / conn->block_size;
+        h = hash_update(FNV_OFFSET, conn->buf + len, r);
+        if (idx < conn->n_hashes && conn->hashes[idx] == h) {
+            if (len > 0)
+                break;
+            conn->scan_pos += r;
+            continue;
+        }
+        if (len == 0)
+            offset = conn->scan_pos;
+        set_block_hash(conn, idx, h);
+        len += r;
+        conn->scan_pos += r;
+    }
+
+    if (len == 0 && conn->update_bytes == 0 &&
+        conn->file_size == conn->server_size) {
+        /* rewritten identical: do not make the viewer reload */
+        close(conn->update_fd);
+        conn->updating = 0;
+        wait_for_changes(conn);
+        return;
+    }
+    if (len == 0) {
+        conn->n_hashes = (conn->file_size + conn->block_size - 1) /
+            conn->block_size;
+        conn->server_size = conn->file_size;
+        conn->commit_sent = 1;
+    } else {
+        set_int64_property(conn, atom.offset, offset);
+    }
+    set_data_property(conn, conn->buf, len);
+    xcb_flush(display);
+    conn->update_bytes += len;
+    conn->tokens       -= len;
+    conn->sent_time     = get_time();
+    conn->state         = CONN_TRANSFER;
+    arm_watchdog(conn);
+}
+
+static void
+finish_update(struct xropen_connection *conn)
+{
+    close(conn->update_fd);
+    conn->updating = 0;
+    if (!option_quiet) {
+        printf("%.64s: updated, %llu bytes sent\n", conn->file_base,
+            (unsigned long long)conn->update_bytes);
+        fflush(stdout);
+    }
+    wait_for_changes(conn);
+}
+
+static void
+send_chunk(struct xropen_connection *conn)
 {
-    uint8_t buf[16384];
     unsigned r;
 
-    if ((r = fread(buf, 1, sizeof(buf), conn->file)) == 0) {
-        if (!option_quiet) {
+    if (conn->updating) {
+        if (conn->commit_sent)
+            finish_update(conn);
+        else
+            send_update_chunk(conn);
+        return;
+    }
+    if ((r = fread(conn->buf, 1, conn->chunk_size, conn->file)) == 0) {
+        if (ferror(conn->file)) {
+            fail_connection(conn, "%s: %s", conn->file_base, strerror(errno));
+            return;
+        }
+        if (!option_quiet && conn->requester < 0) {
             printf("\r%72s\r", "");
             fflush(stdout);
         }
         fclose(conn->file);
         conn->file = NULL;
+        if (conn->watch) {
+            conn->server_size = conn->file_size;
+            if (!option_quiet) {
+                printf("%.64s: watching for changes\n", conn->file_base);
+                fflush(stdout);
+            }
+            wait_for_changes(conn);
+            return;
+        }
+        conn->state = CONN_DONE;
         return;
     }
     print_progress(conn);
-    set_data_property(conn, buf, r);
+    hash_stream(conn, conn->buf, r);
+    set_data_property(conn, conn->buf, r);
     xcb_flush(display);
     conn->file_pos += r;
+    conn->tokens   -= r;
+    conn->sent_time = get_time();
+    conn->state = CONN_TRANSFER;
+    arm_watchdog(conn);
+}
+
+static void
+handle_data_delete(struct xropen_connection *conn)
+{
+    if (conn->state == CONN_TRANSFER && conn->background)
+        update_background_rate(conn, get_time() - conn->sent_time);
+    if (check_rate(conn))
+        send_chunk(conn);
+}
+
+static void
+start_update(struct xropen_connection *conn)
+{
+    struct stat st;
+
+    if ((conn->update_fd = open(conn->file_name, O_RDONLY | O_CLOEXEC)) < 0 ||
+        fstat(conn->update_fd, &st) < 0) {
+        /* being replaced, the next event will tell */
+        if (conn->update_fd >= 0)
+            close(conn->update_fd);
+        conn->dirty = 0;
+        wait_for_changes(conn);
+        return;
+    }
+    conn->file_size    = st.st_size;
+    conn->scan_pos     = 0;
+    conn->updating     = 1;
+    conn->commit_sent  = 0;
+    conn->dirty        = 0;
+    conn->update_bytes = 0;
+    set_int64_property(conn, atom.size, conn->file_size);
+    if (check_rate(conn))
+        send_chunk(conn);
 }
 
 static void
@@ -181,55 +662,702 @@ handle_error(struct xropen_connection *conn)
 {
     xcb_get_property_cookie_t cookie;
     xcb_get_property_reply_t *prop;
-    char *msg = "unknown";
+    char *msg = NULL;
 
     cookie = xcb_get_property(display, 0, conn->client, atom.error,
-        XCB_ATOM_STRING, 0, sizeof(msg) / 4);
+        XCB_ATOM_STRING, 0, 256);
     prop = xcb_get_property_reply(display, cookie, NULL);
-    if (prop != NULL && prop->type != atom.error && prop->format == 8)
+    if (prop != NULL && prop->type == XCB_ATOM_STRING && prop->format == 8)
         msg = copy_string_prop(prop);
-    fprintf(stderr, "%s: remote error: %s\n", program_name, msg);
+    fail_connection(conn, "remote error: %s", msg == NULL ? "unknown" : msg);
+    free(msg);
     free(prop);
-    exit(1);
 }
 
 static void
 handle_property_change(struct xropen_connection *conn,
     xcb_property_notify_event_t *ev)
 {
-    if (ev->window == conn->client && ev->atom == atom.data &&
-        ev->state == XCB_PROPERTY_DELETE)
+    if (conn->state == CONN_DONE)
+        return;
+    if (ev->atom == atom.data && ev->state == XCB_PROPERTY_DELETE &&
+        conn->state != CONN_PACED && conn->state != CONN_WATCH)
         handle_data_delete(conn);
-    if (ev->window == conn->client && ev->atom == atom.error &&
-        ev->state == XCB_PROPERTY_NEW_VALUE)
+    if (ev->atom == atom.error && ev->state == XCB_PROPERTY_NEW_VALUE)
+        handle_error(conn);
+}
+
+static struct xropen_connection *
+find_connection(xcb_window_t window)
+{
+    unsigned i;
+
+    for (i = 0; i < all_conns_size; i++)
+        if (all_conns[i]->client == window)
+            return all_conns[i];
+    return NULL;
+}
+
+static void
+handle_x_error(xcb_generic_error_t *err)
+{
+    struct xropen_connection *conn;
+
+    if (!agent_mode) {
+        fprintf(stderr, "%s: unknown error\n", program_name);
+        exit(1);
+    }
+    if ((conn = find_connection(err->resource_id)) != NULL)
+        fail_connection(conn, "X error %d", err->error_code);
+    else if (err->resource_id == server)
+        server = XCB_NONE;
+}
+
+static void
+handle_event(xcb_generic_event_t *ev)
+{
+    xcb_property_notify_event_t *pev;
+    struct xropen_connection *conn;
+
+    switch (ev->response_type & ~0x80) {
+        case XCB_PROPERTY_NOTIFY:
+            pev = (xcb_property_notify_event_t *)ev;
+            if ((conn = find_connection(pev->window)) != NULL)
+                handle_property_change(conn, pev);
+            break;
+
+        case XCB_DESTROY_NOTIFY:
+            /* the agent watches the server; our windows die with it */
+            if (((xcb_destroy_notify_event_t *)ev)->window == server)
+                server = XCB_NONE;
+            break;
+
+        case 0:
+            handle_x_error((xcb_generic_error_t *)ev);
+            break;
+
+        default:
+            fprintf(stderr, "%s: unknown event type %d\n", program_name,
+                ev->response_type);
+            break;
+    }
+}
+
+static void
+process_queued_events(void)
+{
+    xcb_generic_event_t *ev;
+
+    while ((ev = xcb_poll_for_queued_event(display)) != NULL) {
+        handle_event(ev);
+        free(ev);
+    }
+}
+
+static void
+die_display_lost(void)
+{
+    fprintf(stderr, "%s: lost connection to the display\n", program_name);
+    exit(1);
+}
+
+/*
+ * Called when no PropertyNotify came before the deadline. Query DATA and
+ * ERROR directly: replies are ordered with events, so once the replies are
+ * in, any notification generated before them is already queued. If the
+ * state did not move and DATA is gone, the notification was really lost.
+ */
+static void
+handle_watchdog(struct xropen_connection *conn)
+{
+    xcb_get_property_cookie_t cookie_data, cookie_error;
+    xcb_get_property_reply_t *prop_data, *prop_error;
+    xcb_generic_error_t *err_data = NULL, *err_error = NULL;
+    enum conn_state state = conn->state;
+    uint64_t watchdog = conn->watchdog;
+    unsigned retries = conn->retries;
+    int has_data, has_error;
+
+    cookie_data = xcb_get_property(display, 0, conn->client, atom.data,
+        XCB_GET_PROPERTY_TYPE_ANY, 0, 0);
+    cookie_error = xcb_get_property(display, 0, conn->client, atom.error,
+        XCB_GET_PROPERTY_TYPE_ANY, 0, 0);
+    prop_data  = xcb_get_property_reply(display, cookie_data, &err_data);
+    prop_error = xcb_get_property_reply(display, cookie_error, &err_error);
+    if (prop_data == NULL || prop_error == NULL) {
+        if (err_data == NULL && err_error == NULL)
+            die_display_lost();
+        fail_connection(conn, "transfer window destroyed");
+        free(prop_data);
+        free(prop_error);
+        free(err_data);
+        free(err_error);
+        return;
+    }
+    has_data  = prop_data->type != XCB_NONE;
+    has_error = prop_error->type != XCB_NONE;
+    free(prop_data);
+    free(prop_error);
+
+    process_queued_events();
+    if (conn->state != state || conn->deadline > get_time())
+        return;
+    if (has_error) {
         handle_error(conn);
+        return;
+    }
+    if (!has_data) {
+        handle_data_delete(conn);
+        return;
+    }
+
+    if (++retries > MAX_RETRIES) {
+        fail_connection(conn, "server not responding");
+        return;
+    }
+    /* the server may have missed the ping; older ones do not ignore copies */
+    if (state == CONN_HANDSHAKE && server_caps[CAP_VERSION] >= 1)
+        ping_server(conn);
+    conn->watchdog = watchdog * 2 < WATCHDOG_MAX ? watchdog * 2 : WATCHDOG_MAX;
+    conn->retries  = retries;
+    conn->deadline = get_time() + conn->watchdog;
+}
+
+static void
+start_connection(struct xropen_connection *conn)
+{
+    all_conns[all_conns_size++] = conn;
+    negotiate(conn);
+    create_window(conn);
+    ping_server(conn);
+}
+
+static void
+reply_requester(struct xropen_connection *conn)
+{
+    const char *msg = conn->error == NULL ? "ok" : conn->error;
+
+    /* a detached xropen is gone already, that is fine */
+    send(conn->requester, msg, strlen(msg), MSG_NOSIGNAL);
+    close(conn->requester);
+}
+
+static void
+finish_connection(struct xropen_connection *conn)
+{
+    unsigned i;
+
+    for (i = 0; all_conns[i] != conn; i++);
+    all_conns[i] = all_conns[--all_conns_size];
+    if (conn->client != XCB_NONE)
+        xcb_destroy_window(display, conn->client);
+    if (conn->file != NULL)
+        fclose(conn->file);
+    conn->file = NULL;
+    if (conn->updating)
+        close(conn->update_fd);
+    free(conn->hashes);
+    conn->hashes = NULL;
+    free(conn->buf);
+    conn->buf = NULL;
+    if (conn->requester < 0)
+        return;
+    reply_requester(conn);
+    free(conn->error);
+    free(conn->file_base);
+    free(conn->file_type);
+    free(conn);
+}
+
+static void accept_request(int listen_fd);
+static void read_request(int fd);
+
+/* Watch the directory: the file is often replaced rather than rewritten */
+static void
+start_watch(struct xropen_connection *conn)
+{
+    char *dir, *p;
+
+    if ((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+        die_system_error("inotify_init1");
+    p = strrchr(conn->file_name, '/');
+    dir = calloc_safe(1, p == NULL ? 2 : p - conn->file_name + 2);
+    if (p == NULL)
+        strcpy(dir, ".");
+    else
+        memcpy(dir, conn->file_name, p == conn->file_name ? 1 :
+            p - conn->file_name);
+    if (inotify_add_watch(inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        die_system_error(dir);
+    free(dir);
+    conn->watch = 1;
+}
+
+static void
+handle_inotify(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct xropen_connection *conn;
+    ssize_t r;
+    char *p;
+    unsigned i;
+
+    while ((r = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + r; p += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event *)p;
+            for (i = 0; i < all_conns_size; i++) {
+                conn = all_conns[i];
+                if (!conn->watch || ev->len == 0 ||
+                    strcmp(ev->name, conn->file_base) != 0)
+                    continue;
+                conn->dirty = 1;
+                if (conn->state == CONN_WATCH)
+                    conn->deadline = get_time() + WATCH_DELAY;
+            }
+        }
+    }
+}
+
+/*
+ * Event loop shared by the direct mode, with one connection and no
+ * listening socket, and the agent, which runs until the display goes away.
+ */
+static void
+run_loop(int listen_fd)
+{
+    struct xropen_connection *conn;
+    xcb_generic_event_t *ev;
+    struct pollfd pfd[3 + MAX_PENDING];
+    uint64_t now, next;
+    unsigned i;
+    int timeout, fd;
+
+    pfd[0].fd     = xcb_get_file_descriptor(display);
+    pfd[0].events = POLLIN;
+    pfd[1].fd     = listen_fd;
+    pfd[1].events = POLLIN;
+    pfd[2].fd     = inotify_fd;
+    pfd[2].events = POLLIN;
+    while (all_conns_size > 0 || listen_fd >= 0) {
+        while ((ev = xcb_poll_for_event(display)) != NULL) {
+            handle_event(ev);
+            free(ev);
+        }
+        if (xcb_connection_has_error(display))
+            die_display_lost();
+
+        now = get_time();
+        for (i = 0; i < all_conns_size; i++) {
+            conn = all_conns[i];
+            if (conn->state == CONN_DONE || now < conn->deadline)
+                continue;
+            if (conn->state == CONN_PACED)
+                send_chunk(conn);
+            else if (conn->state == CONN_WATCH)
+                start_update(conn);
+            else
+                handle_watchdog(conn);
+        }
+        for (i = 0; i < all_conns_size; i++) {
+            if (all_conns[i]->state != CONN_DONE)
+                continue;
+            /* the last connection takes this slot */
+            finish_connection(all_conns[i--]);
+        }
+        if (all_conns_size == 0 && listen_fd < 0)
+            break;
+
+        now  = get_time();
+        next = UINT64_MAX;
+        for (i = 0; i < all_conns_size; i++)
+            if (all_conns[i]->deadline < next)
+                next = all_conns[i]->deadline;
+        timeout = next == UINT64_MAX ? -1 :
+                  next <= now ? 0 : (int)((next - now + 999) / 1000);
+        for (i = 0; i < pending_size; i++) {
+            pfd[3 + i].fd     = pending[i];
+            pfd[3 + i].events = POLLIN;
+        }
+        xcb_flush(display);
+        if (poll(pfd, 3 + pending_size, timeout) < 0) {
+            if (errno != EINTR)
+                die_system_error("poll");
+            continue;
+        }
+        for (i = pending_size; i-- > 0;) {
+            if (pfd[3 + i].revents == 0)
+                continue;
+            fd = pending[i];
+            memmove(&pending[i], &pending[i + 1],
+                (--pending_size - i) * sizeof(*pending));
+            read_request(fd);
+        }
+        if (listen_fd >= 0 && (pfd[1].revents & POLLIN))
+            accept_request(listen_fd);
+        if (inotify_fd >= 0 && (pfd[2].revents & POLLIN))
+            handle_inotify();
+    }
+}
+
+/*
+ * The agent listens on a per-user, per-display socket. The path can be
+ * forced with $XROPEN_AGENT; an empty value disables the agent.
+ */
+static int
+get_agent_path(void)
+{
+    const char *env = getenv("XROPEN_AGENT");
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    const char *disp = getenv("DISPLAY");
+    char *p;
+    int len;
+
+    if (env != NULL) {
+        if (*env == 0 || strlen(env) >= sizeof(agent_path))
+            return -1;
+        strcpy(agent_path, env);
+        return 0;
+    }
+    if (disp == NULL)
+        return -1;
+    if (dir == NULL || *dir == 0)
+        dir = "/tmp";
+    len = snprintf(agent_path, sizeof(agent_path), "%s/xropen-agent-%u-%s",
+        dir, (unsigned)getuid(), disp);
+    if (len < 0 || (unsigned)len >= sizeof(agent_path))
+        return -1;
+    for (p = agent_path + strlen(dir) + 1; *p != 0; p++)
+        if (*p == '/')
+            *p = '_';
+    return 0;
+}
+
+/* Only talk to processes of the same user, even in a shared /tmp */
+static int
+check_peer(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+           cred.uid == getuid() ? 0 : -1;
+}
+
+static int
+connect_agent(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (get_agent_path() < 0)
+        return -1;
+    strcpy(addr.sun_path, agent_path);
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        check_peer(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Request packet: "key value" lines, with the file descriptor attached.
+ * The reply is "ok" or an error message, sent when the transfer is done.
+ */
+static int
+send_to_agent(struct xropen_connection *conn)
+{
+    char req[MAX_REQUEST], reply[MAX_REQUEST];
+    char control[CMSG_SPACE(sizeof(int))] = { 0 };
+    struct iovec iov;
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    int fd, len;
+    ssize_t r;
+
+    if ((fd = connect_agent()) < 0)
+        return -1;
+    len = snprintf(req, sizeof(req), "name %s\nrate %.0f\nbackground %d\n",
+        conn->file_base, option_rate, option_background);
+    if (conn->file_type != NULL && len >= 0 && (unsigned)len < sizeof(req))
+        len += snprintf(req + len, sizeof(req) - len, "type %s\n",
+            conn->file_type);
+    if (len < 0 || (unsigned)len >= sizeof(req)) {
+        close(fd);
+        return -1;
+    }
+
+    iov.iov_base = req;
+    iov.iov_len  = len;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &(int){ fileno(conn->file) }, sizeof(int));
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != len) {
+        close(fd);
+        return -1;
+    }
+    if (option_detach)
+        exit(0);
+
+    if ((r = recv(fd, reply, sizeof(reply) - 1, 0)) <= 0) {
+        fprintf(stderr, "%s: agent terminated during the transfer\n",
+            program_name);
+        exit(1);
+    }
+    reply[r] = 0;
+    if (strcmp(reply, "ok") == 0)
+        exit(0);
+    fprintf(stderr, "%s: %s\n", program_name, reply);
+    exit(1);
+}
+
+static void
+reject_request(int fd, const char *msg)
+{
+    send(fd, msg, strlen(msg), MSG_NOSIGNAL);
+    close(fd);
+}
+
+static char *
+strdup_safe(const char *s)
+{
+    size_t len = strlen(s);
+    char *r = calloc_safe(1, len + 1);
+
+    memcpy(r, s, len + 1);
+    return r;
+}
+
+/* Also false for NaN */
+static int
+is_valid_rate(double rate)
+{
+    return rate >= MIN_RATE && !isinf(rate);
+}
+
+/* The request is read when it arrives, a silent peer must not block us */
+static void
+accept_request(int listen_fd)
+{
+    int fd;
+
+    if ((fd = accept4(listen_fd, NULL, NULL,
+        SOCK_CLOEXEC | SOCK_NONBLOCK)) < 0)
+        return;
+    if (check_peer(fd) < 0) {
+        close(fd);
+        return;
+    }
+    if (pending_size == MAX_PENDING) {
+        close(pending[0]);
+        memmove(&pending[0], &pending[1],
+            (--pending_size) * sizeof(*pending));
+    }
+    pending[pending_size++] = fd;
+}
+
+static void
+read_request(int fd)
+{
+    struct xropen_connection *conn;
+    char req[MAX_REQUEST];
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { req, sizeof(req) - 1 };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    char *line, *value, *next;
+    int file_fd = -1;
+    ssize_t r;
+
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    if ((r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) <= 0) {
+        close(fd);
+        return;
+    }
+    req[r] = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&file_fd, CMSG_DATA(cmsg), sizeof(int));
+    if (file_fd < 0) {
+        reject_request(fd, "agent: no file received");
+        return;
+    }
+    if (all_conns_size == MAX_CONNS) {
+        close(file_fd);
+        reject_request(fd, "agent: too many transfers");
+        return;
+    }
+
+    conn = calloc_safe(1, sizeof(*conn));
+    conn->requester = fd;
+    for (line = req; line != NULL && *line != 0; line = next) {
+        if ((next = strchr(line, '\n')) != NULL)
+            *(next++) = 0;
+        if ((value = strchr(line, ' ')) == NULL)
+            continue;
+        *(value++) = 0;
+        if (strcmp(line, "name") == 0 && conn->file_base == NULL)
+            conn->file_base = strdup_safe(value);
+        else if (strcmp(line, "type") == 0 && conn->file_type == NULL)
+            conn->file_type = strdup_safe(value);
+        else if (strcmp(line, "rate") == 0)
+            conn->rate_cap = strtod(value, NULL);
+        else if (strcmp(line, "background") == 0)
+            conn->background = atoi(value);
+    }
+    if (conn->file_base == NULL)
+        conn->file_base = strdup_safe("file");
+    conn->file_name = conn->file_base;
+    /* 0 for unlimited, otherwise what parse_rate() accepts */
+    if (conn->rate_cap != 0 && !is_valid_rate(conn->rate_cap)) {
+        close(file_fd);
+        fail_connection(conn, "agent: invalid rate");
+        all_conns[all_conns_size++] = conn;
+        return;
+    }
+
+    if ((conn->file = fdopen(file_fd, "r")) == NULL ||
+        fseeko(conn->file, 0, SEEK_END) < 0 ||
+        (conn->file_size = ftello(conn->file)) < 0 ||
+        fseeko(conn->file, 0, SEEK_SET) < 0) {
+        if (conn->file == NULL)
+            close(file_fd);
+        fail_connection(conn, "agent: %s: %s", conn->file_base,
+            strerror(errno));
+        all_conns[all_conns_size++] = conn;
+        return;
+    }
+
+    /* the server is looked up once, and again only if it went away */
+    if (server == XCB_NONE) {
+        if (find_server() < 0) {
+            fail_connection(conn, "no server found.");
+            all_conns[all_conns_size++] = conn;
+            return;
+        }
+        xcb_change_window_attributes(display, server, XCB_CW_EVENT_MASK,
+            (uint32_t[]){ XCB_EVENT_MASK_STRUCTURE_NOTIFY });
+    }
+    start_connection(conn);
+}
+
+static void
+remove_agent_socket(void)
+{
+    unlink(agent_path);
+}
+
+static void
+run_agent(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (get_agent_path() < 0) {
+        fprintf(stderr, "%s: no path for the agent socket\n", program_name);
+        exit(1);
+    }
+    if ((fd = connect_agent()) >= 0) {
+        fprintf(stderr, "%s: an agent is already running on %s\n",
+            program_name, agent_path);
+        exit(1);
+    }
+    start_display();
+
+    strcpy(addr.sun_path, agent_path);
+    unlink(agent_path);
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+        die_system_error("socket");
+    umask(077);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        die_system_error(agent_path);
+    atexit(remove_agent_socket);
+    if (listen(fd, 64) < 0)
+        die_system_error("listen");
+
+    agent_mode = 1;
+    run_loop(fd);
+}
+
+/* Bytes per second, with an optional k, M or G suffix */
+static double
+parse_rate(const char *arg)
+{
+    char *end;
+    double rate = strtod(arg, &end);
+
+    switch (*end) {
+        case 'k': case 'K': rate *= 1024; end++; break;
+        case 'm': case 'M': rate *= 1024 * 1024; end++; break;
+        case 'g': case 'G': rate *= 1024 * 1024 * 1024; end++; break;
+    }
+    if (*end != 0 || end == arg || !is_valid_rate(rate)) {
+        fprintf(stderr, "%s: invalid rate (minimum %.0f): %s\n",
+            program_name, MIN_RATE, arg);
+        exit(1);
+    }
+    return rate;
 }
 
 int
 main(int argc, char **argv)
 {
     int opt;
-    struct xropen_connection conn = { 0 };
+    struct xropen_connection conn = { .requester = -1 };
     char *p;
-    xcb_generic_event_t *ev;
 
-    while ((opt = getopt(argc, argv, "ht:q")) != -1) {
+    while ((opt = getopt(argc, argv, "Abhnr:t:qw")) != -1) {
         switch (opt) {
+            case 'A':
+                agent_mode++;
+                break;
+            case 'b':
+                option_background++;
+                break;
+            case 'n':
+                option_detach++;
+                break;
+            case 'r':
+                option_rate = parse_rate(optarg);
+                break;
             case 't':
                 conn.file_type = optarg;
                 break;
             case 'q':
                 option_quiet++;
                 break;
+            case 'w':
+                option_watch++;
+                break;
             case 'h':
                 usage(0);
+                break;
             default:
                 usage(1);
         }
     }
     argc -= optind;
     argv += optind;
-    if (argc == 0)
+    if (agent_mode) {
+        if (argc != 0)
+            usage(1);
+        run_agent();
+        return 0;
+    }
+    if (argc == 0 || (option_watch && option_detach))
         usage(1);
     conn.file_name = argv[0];
     p = strrchr(conn.file_name, '/');
@@ -243,30 +1371,31 @@ main(int argc, char **argv)
     if ((fseeko(conn.file, 0, SEEK_SET)) < 0)
         die_system_error(conn.file_name);
 
-    start_display();
-    find_server(&conn);
-    create_window(&conn);
-    ping_server(&conn);
-
-    while ((ev = xcb_wait_for_event(display)) != NULL) {
-        switch (ev->response_type & ~0x80) {
-            case XCB_PROPERTY_NOTIFY:
-                handle_property_change(&conn,
-                    (xcb_property_notify_event_t *)ev);
-                break;
-
-            case 0:
-                fprintf(stderr, "%s: unknown error\n", program_name);
-                exit(1);
+    /* a watch session lives as long as this process */
+    if (!option_watch)
+        send_to_agent(&conn);
 
-            default:
-                fprintf(stderr, "%s: unknown event type %d\n", program_name,
-                    ev->response_type);
-                break;
+    conn.rate_cap   = option_rate;
+    conn.background = option_background;
+    start_display();
+    if (find_server() < 0) {
+        fprintf(stderr, "%s: no server found.\n", program_name);
+        exit(1);
+    }
+    if (option_watch) {
+        if (!(server_caps[CAP_MODES] & MODE_WATCH)) {
+            fprintf(stderr, "%s: the server does not support watch mode\n",
+                program_name);
+            exit(1);
         }
-        free(ev);
-        if (conn.file == NULL)
-            break;
+        start_watch(&conn);
+    }
+    start_connection(&conn);
+    run_loop(-1);
+    if (conn.error != NULL) {
+        fprintf(stderr, "%s%s: %s\n", option_quiet ? "" : "\n",
+            program_name, conn.error);
+        exit(1);
     }
 
     xcb_disconnect(display);
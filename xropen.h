@@ -13,7 +13,8 @@
 
 extern const char *program_name;
 
-extern xcb_connection_t *display;
+/* One connection per thread in xropen-server */
+extern __thread xcb_connection_t *display;
 
 struct ropen_atoms {
     xcb_atom_t xropen;
@@ -23,11 +24,54 @@ struct ropen_atoms {
     xcb_atom_t content_type;
     xcb_atom_t size;
     xcb_atom_t error;
+    xcb_atom_t capabilities;
+    xcb_atom_t flags;
+    xcb_atom_t offset;
+    xcb_atom_t token;
 };
 
+/*
+ * The server advertises what it supports in the XROPEN-CAPABILITIES
+ * property of its window, an INTEGER array indexed by enum capability.
+ * Clients must accept longer arrays; a missing property means version 0:
+ * 16k chunks, no optional mode.
+ */
+enum capability {
+    CAP_VERSION,
+    CAP_MAX_DATA_SIZE,
+    CAP_MODES,
+    CAP_CODECS,
+    CAP_MAX_CLIENTS,
+    CAP_ACTIVE_CLIENTS,
+    N_CAPS
+};
+
+#define PROTOCOL_VERSION 1
+
+#define MODE_CHUNKED    (1 << 0)
+#define MODE_INLINE     (1 << 1)    /* first chunk set before the ping */
+#define MODE_WATCH      (1 << 2)    /* FLAG_WATCH and OFFSET updates */
+
+/*
+ * Flags set by the client in its FLAGS property (INTEGER) before the ping.
+ * With FLAG_WATCH, the session stays open after the file is opened: each
+ * update is a series of DATA chunks at the position given by OFFSET, with
+ * the new SIZE, ended by an empty DATA that makes it visible at once.
+ */
+#define FLAG_WATCH      (1 << 0)
+
+/*
+ * The client sets TOKEN (INTEGER) to a nonzero value and sends it as the
+ * second word of its pings. The server deletes it when it accepts the
+ * client, so that a late copy of the ping is recognized and ignored.
+ */
+
+#define CODEC_RAW       (1 << 0)
+
 extern struct ropen_atoms atom;
 
 void start_display(void);
 void *calloc_safe(size_t n, size_t s);
 void set_property_string(xcb_window_t win, xcb_atom_t atom, const char *str);
 char *copy_string_prop(xcb_get_property_reply_t *prop);
+uint64_t get_time(void);